@@ -0,0 +1,171 @@
+/*====================== batch.c ========================
+  Renders many scripts in one process on a pool of worker
+  threads. Each worker owns a render_ctx (screen, edge and
+  transform matrices, mesh instances) and reuses it for every job it takes,
+  so a job costs no allocation beyond what its geometry needs.
+  ==================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "ml6.h"
+#include "display.h"
+#include "matrix.h"
+#include "mesh.h"
+#include "parser.h"
+#include "batch.h"
+
+struct batch {
+    char **files;
+    int *status;
+    int count;
+    int next;
+    pthread_mutex_t lock;
+};
+
+struct render_ctx * new_render_ctx() {
+    struct render_ctx *ctx;
+
+    ctx = (struct render_ctx *)malloc(sizeof(struct render_ctx));
+    ctx->s = (screen *)malloc(sizeof(screen));
+    ctx->edges = new_matrix(POINT_ROWS, 4);
+    ctx->transform = new_matrix(4, 4);
+    ctx->instances = new_instances();
+    return ctx;
+}
+
+void free_render_ctx(struct render_ctx *ctx) {
+    free(ctx->s);
+    free_matrix(ctx->edges);
+    free_matrix(ctx->transform);
+    free_instances(ctx->instances);
+    free(ctx);
+}
+
+int default_threads() {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+}
+
+/*
+  Reads a manifest of script names, one per line.
+  Blank lines and lines starting with # are skipped.
+*/
+char ** read_manifest(char *file, int *count) {
+    FILE *f;
+    char line[256];
+    char **files;
+    int size = 16;
+    int len;
+
+    f = fopen(file, "r");
+    if ( f == NULL )
+        return NULL;
+
+    files = (char **)malloc(size * sizeof(char *));
+    *count = 0;
+    while ( fgets(line, 255, f) != NULL ) {
+        len = strlen(line);
+        while ( len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r') )
+            line[--len] = '\0';
+        if ( len == 0 || line[0] == '#' )
+            continue;
+        if ( *count == size ) {
+            size *= 2;
+            files = realloc(files, size * sizeof(char *));
+        }
+        files[(*count)++] = strdup(line);
+    }
+    fclose(f);
+    return files;
+}
+
+void free_manifest(char **files, int count) {
+    int i;
+    for (i = 0; i < count; i++)
+        free(files[i]);
+    free(files);
+}
+
+static int next_job(struct batch *b) {
+    int job;
+    pthread_mutex_lock(&b->lock);
+    job = b->next < b->count ? b->next++ : -1;
+    pthread_mutex_unlock(&b->lock);
+    return job;
+}
+
+static void * batch_worker(void *arg) {
+    struct batch *b = (struct batch *)arg;
+    struct render_ctx *ctx = new_render_ctx();
+    int job;
+
+    //the pool already uses every core
+    set_encode_threads(1);
+
+    while ( (job = next_job(b)) >= 0 )
+        b->status[job] = parse_file(b->files[job], ctx->transform, ctx->edges, ctx->instances, *ctx->s);
+
+    free_render_ctx(ctx);
+    return NULL;
+}
+
+static double seconds_since(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/*
+  Renders every script in files on up to threads workers.
+  Returns the number of jobs that failed.
+*/
+int run_batch(char **files, int count, int threads) {
+    struct batch b;
+    struct timespec start;
+    pthread_t *workers;
+    double elapsed;
+    int i, failed, started;
+
+    if ( threads > count )
+        threads = count;
+    if ( threads < 1 )
+        threads = 1;
+
+    b.files = files;
+    b.count = count;
+    b.next = 0;
+    b.status = (int *)calloc(count, sizeof(int));
+    pthread_mutex_init(&b.lock, NULL);
+    workers = (pthread_t *)malloc(threads * sizeof(pthread_t));
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    started = 0;
+    for (i = 0; i < threads; i++)
+        if ( pthread_create(&workers[started], NULL, batch_worker, &b) == 0 )
+            started++;
+    //with no workers at all, take every job on this thread
+    if ( started == 0 )
+        batch_worker(&b);
+    for (i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+    elapsed = seconds_since(&start);
+
+    failed = 0;
+    for (i = 0; i < count; i++)
+        if ( b.status[i] ) {
+            printf("job %d (%s) failed\n", i, files[i]);
+            failed++;
+        }
+    printf("batch: %d jobs, %d failed, %d threads, %.3f s, %.1f jobs/s\n",
+           count, failed, started ? started : 1, elapsed, elapsed > 0 ? count / elapsed : 0);
+
+    pthread_mutex_destroy(&b.lock);
+    free(workers);
+    free(b.status);
+    return failed;
+}
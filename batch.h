@@ -0,0 +1,27 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "matrix.h"
+#include "ml6.h"
+#include "mesh.h"
+
+/*
+  Everything one script needs to render. A worker keeps one of these
+  for its whole life and reuses it for every job it runs.
+*/
+struct render_ctx {
+  screen *s;
+  struct matrix *edges;
+  struct matrix *transform;
+  struct instances *instances;
+};
+
+struct render_ctx * new_render_ctx();
+void free_render_ctx(struct render_ctx *ctx);
+
+int default_threads();
+char ** read_manifest(char *file, int *count);
+void free_manifest(char **files, int count);
+int run_batch(char **files, int count, int threads);
+
+#endif
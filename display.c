@@ -4,18 +4,56 @@
 
   A color is an ordered triple of ints, with each value standing
   for red, green and blue respectively
+
+  A screen can also be mirrored into a memory mapped binary ppm
+  (P6) with map_screen. While mapped, plot and clear_screen write
+  straight into the file and save only has to sync or clone it.
+  The mapping belongs to the calling thread.
   ==================================================*/
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
 
 #include "ml6.h"
 #include "display.h"
 
+#define P6_HEADER_MAX 32
+
+static __thread unsigned char *mapped = NULL;
+static __thread unsigned char *mapped_pixels;
+static __thread size_t mapped_len;
+static __thread int mapped_fd = -1;
+static __thread char mapped_file[256];
+
+//a P6 byte can't hold out of range colors, so clamp them like a viewer would
+static unsigned char channel( int v) {
+    return v < 0 ? 0 : v > MAX_COLOR ? MAX_COLOR : v;
+}
+
 void plot( screen s, color c, int x, int y) {
     int newy = YRES - 1 - y;
-    if ( x >= 0 && x < XRES && newy >=0 && newy < YRES )
+    unsigned char *p;
+    if ( x >= 0 && x < XRES && newy >=0 && newy < YRES ) {
         s[x][newy] = c;
+        if ( mapped ) {
+            p = mapped_pixels + 3 * (newy * XRES + x);
+            p[0] = channel(c.red);
+            p[1] = channel(c.green);
+            p[2] = channel(c.blue);
+        }
+    }
 }
 
 void clear_screen( screen s ) {
@@ -30,58 +68,308 @@ void clear_screen( screen s ) {
     for ( y=0; y < YRES; y++ )
         for ( x=0; x < XRES; x++)      
             s[x][y] = c;
+
+    if ( mapped )
+        memset(mapped_pixels, 0, 3 * XRES * YRES);
+}
+
+/*
+  Creates file as a P6 ppm holding the current contents of s
+  and maps it, so later plots land in the file directly.
+  Replaces any mapping this thread already had.
+*/
+int map_screen( screen s, char *file) {
+
+    char header[P6_HEADER_MAX];
+    int x, y, hlen;
+    unsigned char *p;
+
+    unmap_screen();
+
+    hlen = sprintf(header, "P6\n%d %d\n%d\n", XRES, YRES, MAX_COLOR);
+    mapped_len = hlen + 3 * XRES * YRES;
+
+    mapped_fd = open(file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if ( mapped_fd < 0 || ftruncate(mapped_fd, mapped_len) < 0 ) {
+        printf("could not create %s\n", file);
+        if ( mapped_fd >= 0 )
+            close(mapped_fd);
+        mapped_fd = -1;
+        return -1;
+    }
+    p = mmap(NULL, mapped_len, PROT_READ | PROT_WRITE, MAP_SHARED, mapped_fd, 0);
+    if ( p == MAP_FAILED ) {
+        printf("could not map %s\n", file);
+        close(mapped_fd);
+        mapped_fd = -1;
+        return -1;
+    }
+
+    memcpy(p, header, hlen);
+    mapped = p;
+    mapped_pixels = p + hlen;
+    p = mapped_pixels;
+    for ( y=0; y < YRES; y++ )
+        for ( x=0; x < XRES; x++, p += 3) {
+            p[0] = channel(s[x][y].red);
+            p[1] = channel(s[x][y].green);
+            p[2] = channel(s[x][y].blue);
+        }
+    strncpy(mapped_file, file, sizeof(mapped_file) - 1);
+    mapped_file[sizeof(mapped_file) - 1] = '\0';
+    return 0;
+}
+
+void unmap_screen() {
+    if ( !mapped )
+        return;
+    munmap(mapped, mapped_len);
+    close(mapped_fd);
+    mapped = NULL;
+    mapped_fd = -1;
 }
 
-void save_ppm( screen s, char *file) {
+/*
+  True if file names the mapped file itself, under any path
+  or hard link. Opening that with O_TRUNC would cut the pages
+  out from under the mapping.
+*/
+static int is_mapped_file( char *file) {
+    struct stat a, b;
+
+    if ( stat(file, &a) < 0 || fstat(mapped_fd, &b) < 0 )
+        return 0;
+    return a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+}
+
+/*
+  Saves the mapped screen as file. Saving to the mapped file
+  itself is just a sync; any other name gets a reflink clone
+  when the filesystem supports it, or one write of the bytes.
+*/
+static int save_mapped( char *file) {
+
+    int fd;
+    size_t done;
+    ssize_t n;
+
+    if ( msync(mapped, mapped_len, MS_SYNC) < 0 ) {
+        printf("could not sync %s\n", mapped_file);
+        return -1;
+    }
+    if ( is_mapped_file(file) )
+        return 0;
+
+    fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if ( fd < 0 ) {
+        printf("could not write %s\n", file);
+        return -1;
+    }
+#ifdef FICLONE
+    if ( ioctl(fd, FICLONE, mapped_fd) == 0 ) {
+        close(fd);
+        return 0;
+    }
+#endif
+    for ( done = 0; done < mapped_len; done += n ) {
+        n = write(fd, mapped + done, mapped_len - done);
+        if ( n <= 0 ) {
+            printf("could not write %s\n", file);
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+    return 0;
+}
+
+/*
+  P3 encoding. Rows are formatted in bands on separate threads
+  into their own buffers, using a lookup table for 0-255, and the
+  bands are then written out with a single writev. The bytes are
+  the same as printing every pixel with "%d %d %d ".
+*/
+struct band {
+    struct point_t (*s)[YRES];
+    int y0, y1;
+    char *buf;
+    size_t len, size;
+};
+
+//longest possible "%d " for an int
+#define ASCII_INT_MAX 12
+#define ROW_MAX (XRES * 3 * ASCII_INT_MAX + 1)
+
+//0 means one band per online CPU
+static __thread int encode_threads = 0;
+
+static char ascii_table[MAX_COLOR + 1][4];
+static unsigned char ascii_len[MAX_COLOR + 1];
+static pthread_once_t ascii_once = PTHREAD_ONCE_INIT;
+
+static void make_ascii_table() {
+    int i;
+    for (i = 0; i <= MAX_COLOR; i++) {
+        sprintf(ascii_table[i], "%d", i);
+        ascii_len[i] = strlen(ascii_table[i]) + 1;
+        ascii_table[i][ascii_len[i] - 1] = ' ';
+    }
+}
 
+static char * put_value( char *p, int v) {
+    if ( v >= 0 && v <= MAX_COLOR ) {
+        memcpy(p, ascii_table[v], 4);
+        return p + ascii_len[v];
+    }
+    return p + sprintf(p, "%d ", v);
+}
+
+static void * encode_band( void *arg) {
+    struct band *b = (struct band *)arg;
     int x, y;
+    char *p;
+
+    for ( y = b->y0; y < b->y1; y++ ) {
+        //memcpy above copies 4 bytes, so keep one spare
+        if ( b->size - b->len < ROW_MAX + 1 ) {
+            b->size = 2 * b->size + ROW_MAX + 1;
+            b->buf = realloc(b->buf, b->size);
+        }
+        p = b->buf + b->len;
+        for ( x = 0; x < XRES; x++ ) {
+            p = put_value(p, b->s[x][y].red);
+            p = put_value(p, b->s[x][y].green);
+            p = put_value(p, b->s[x][y].blue);
+        }
+        *p++ = '\n';
+        b->len = p - b->buf;
+    }
+    return NULL;
+}
+
+static int write_all( int fd, struct iovec *iov, int count) {
+    ssize_t n;
+
+    while ( count > 0 ) {
+        n = writev(fd, iov, count);
+        if ( n < 0 && errno == EINTR )
+            continue;
+        if ( n < 0 )
+            return -1;
+        while ( count > 0 && (size_t)n >= iov->iov_len ) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if ( count > 0 ) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/*
+  Sets how many threads write_ppm may use from the calling thread.
+  Pool workers that already keep every core busy set this to 1.
+*/
+void set_encode_threads( int n) {
+    encode_threads = n;
+}
+
+int write_ppm( screen s, FILE *f) {
+
+    struct band bands[YRES];
+    struct iovec iov[YRES];
+    pthread_t threads[YRES];
+    int started[YRES];
+    long nbands;
+    int i, fd, status;
+
+    pthread_once(&ascii_once, make_ascii_table);
+
+    nbands = encode_threads > 0 ? encode_threads : sysconf(_SC_NPROCESSORS_ONLN);
+    if ( nbands < 1 )
+        nbands = 1;
+    if ( nbands > YRES )
+        nbands = YRES;
+
+    for ( i = 0; i < nbands; i++ ) {
+        bands[i].s = s;
+        bands[i].y0 = YRES * i / nbands;
+        bands[i].y1 = YRES * (i + 1) / nbands;
+        //most values are under 4 characters with their space
+        bands[i].size = (bands[i].y1 - bands[i].y0) * (XRES * 3 * 4 + 1) + P6_HEADER_MAX;
+        bands[i].buf = malloc(bands[i].size);
+        bands[i].len = 0;
+    }
+    bands[0].len = sprintf(bands[0].buf, "P3\n%d %d\n%d\n", XRES, YRES, MAX_COLOR);
+
+    //a band whose thread can't be started is encoded here instead
+    for ( i = 1; i < nbands; i++ )
+        started[i] = pthread_create(&threads[i], NULL, encode_band, &bands[i]) == 0;
+    encode_band(&bands[0]);
+    for ( i = 1; i < nbands; i++ )
+        if ( started[i] )
+            pthread_join(threads[i], NULL);
+        else
+            encode_band(&bands[i]);
+
+    for ( i = 0; i < nbands; i++ ) {
+        iov[i].iov_base = bands[i].buf;
+        iov[i].iov_len = bands[i].len;
+    }
+    status = fflush(f) == 0 ? 0 : -1;
+    fd = fileno(f);
+    if ( status == 0 && fd >= 0 )
+        status = write_all(fd, iov, nbands);
+    else
+        for ( i = 0; i < nbands && status == 0; i++ )
+            if ( fwrite(bands[i].buf, 1, bands[i].len, f) != bands[i].len )
+                status = -1;
+
+    for ( i = 0; i < nbands; i++ )
+        free(bands[i].buf);
+    return status;
+}
+
+int save_ppm( screen s, char *file) {
+
     FILE *f;
 
-    f = fopen(file, "w");
-    fprintf(f, "P3\n%d %d\n%d\n", XRES, YRES, MAX_COLOR);
-    for ( y=0; y < YRES; y++ ) {
-        for ( x=0; x < XRES; x++) 
+    if ( mapped )
+        return save_mapped(file);
 
-            fprintf(f, "%d %d %d ", s[x][y].red, s[x][y].green, s[x][y].blue);
-        fprintf(f, "\n");
+    f = fopen(file, "w");
+    if ( f == NULL ) {
+        printf("could not write %s\n", file);
+        return -1;
     }
-    fclose(f);
+    if ( write_ppm(s, f) | fclose(f) ) {
+        printf("could not write %s\n", file);
+        return -1;
+    }
+    return 0;
 }
 
 void save_extension( screen s, char *file) {
 
-    int x, y;
     FILE *f;
     char line[256];
 
     sprintf(line, "convert - %s", file);
 
     f = popen(line, "w");
-    fprintf(f, "P3\n%d %d\n%d\n", XRES, YRES, MAX_COLOR);
-    for ( y=0; y < YRES; y++ ) {
-        for ( x=0; x < XRES; x++) 
-
-            fprintf(f, "%d %d %d ", s[x][y].red, s[x][y].green, s[x][y].blue);
-        fprintf(f, "\n");
-    }
+    write_ppm(s, f);
     pclose(f);
 }
 
 
 void display( screen s) {
 
-    int x, y;
     FILE *f;
 
     f = popen("display", "w");
-
-    fprintf(f, "P3\n%d %d\n%d\n", XRES, YRES, MAX_COLOR);
-    for ( y=0; y < YRES; y++ ) {
-        for ( x=0; x < XRES; x++) 
-
-            fprintf(f, "%d %d %d ", s[x][y].red, s[x][y].green, s[x][y].blue);
-        fprintf(f, "\n");
-    }
+    write_ppm(s, f);
     pclose(f);
 }
-
@@ -1,9 +1,15 @@
 #ifndef DISPLAY_H
 #define DISPLAY_H
 
+#include <stdio.h>
+
 void plot( screen s, color c, int x, int y);
 void clear_screen( screen s);
-void save_ppm( screen s, char *file);
+int map_screen( screen s, char *file);
+void unmap_screen();
+void set_encode_threads( int n);
+int write_ppm( screen s, FILE *f);
+int save_ppm( screen s, char *file);
 void save_extension( screen s, char *file);
 void display( screen s);
 
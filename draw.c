@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "ml6.h"
 #include "display.h"
@@ -22,51 +24,115 @@ void add_box(struct matrix * edges, double x, double y, double z, double width,
     add_edge(edges, x + width, y - height, z - depth, x, y - height, z - depth);
 }
 
-void add_sphere(struct matrix * edges, double cx, double cy, double cz, double r, int steps) {
-    struct matrix * sphere_points = new_matrix(4, 4);
-    double phi, theta;
-    double phi_step = 2 * M_PI / steps;
-    double theta_step = M_PI / steps;
-    int i, j;
-    for (i = 1; i <= steps; i++) {
-        phi = i * phi_step;
-        for (j = 1; j <= steps; j++) {
-            theta = j * theta_step;
-            add_point(sphere_points, r * cos(theta) + cx, r * sin(theta) * cos(phi) + cy, r * sin(theta) * sin(phi) + cz);
-        }
-    }
+/*
+  Spheres and tori know their size up front: steps * steps points,
+  each drawn as a one pixel edge. Their edges are written straight
+  into place after one grow, and for large step counts the phi
+  rows are split across threads.
+*/
+#define PARALLEL_SURFACE_POINTS 40000
+#define SURFACE_SPHERE 0
+#define SURFACE_TORUS 1
 
-    double x, y, z;
-    for (i = 0; i < sphere_points->lastcol; i++) {
-        x = sphere_points->m[0][i];
-        y = sphere_points->m[1][i];
-        z = sphere_points->m[2][i];
-        add_edge(edges, x, y, z, x + 1, y + 1, z + 1);
+struct surface {
+    struct matrix *edges;
+    int type;
+    double cx, cy, cz, r1, r2;
+    int steps;
+    int i0, i1;
+};
+
+static void put_point_edge(struct matrix *edges, int col, double x, double y, double z) {
+    scalar **m = edges->m;
+    m[0][col] = x;
+    m[1][col] = y;
+    m[2][col] = z;
+    m[0][col + 1] = m[0][col] + 1;
+    m[1][col + 1] = m[1][col] + 1;
+    m[2][col + 1] = m[2][col] + 1;
+    if ( edges->rows > 3 ) {
+        m[3][col] = 1;
+        m[3][col + 1] = 1;
     }
-    free_matrix(sphere_points);
 }
 
-void add_torus(struct matrix * edges, double cx, double cy, double cz, double r1, double r2, int steps) {
-    struct matrix * torus_points = new_matrix(4, 4);
+static void * surface_rows(void *arg) {
+    struct surface *sf = (struct surface *)arg;
     double phi, theta;
-    double phi_step = 2 * M_PI / steps;
-    int i, j;
-    for (i = 1; i <= steps; i++) {
+    double phi_step = 2 * M_PI / sf->steps;
+    double theta_step = M_PI / sf->steps;
+    int i, j, col;
+
+    col = sf->edges->lastcol + 2 * (sf->i0 - 1) * sf->steps;
+    for (i = sf->i0; i < sf->i1; i++) {
         phi = i * phi_step;
-        for (j = 1; j <= steps; j++) {
-            theta = j * phi_step;
-            add_point(torus_points, cos(phi) * (r1 * cos(theta) + r2) + cx, r1 * sin(theta) + cy, -1 * sin(phi) * (r1 * cos(theta) + r2) + cz);
+        for (j = 1; j <= sf->steps; j++, col += 2) {
+            if ( sf->type == SURFACE_SPHERE ) {
+                theta = j * theta_step;
+                put_point_edge(sf->edges, col,
+                               sf->r1 * cos(theta) + sf->cx,
+                               sf->r1 * sin(theta) * cos(phi) + sf->cy,
+                               sf->r1 * sin(theta) * sin(phi) + sf->cz);
+            } else {
+                theta = j * phi_step;
+                put_point_edge(sf->edges, col,
+                               cos(phi) * (sf->r1 * cos(theta) + sf->r2) + sf->cx,
+                               sf->r1 * sin(theta) + sf->cy,
+                               -1 * sin(phi) * (sf->r1 * cos(theta) + sf->r2) + sf->cz);
+            }
         }
     }
+    return NULL;
+}
+
+static void add_surface(struct surface *sf) {
+    struct surface parts[64];
+    pthread_t threads[64];
+    int started[64];
+    int need = sf->edges->lastcol + 2 * sf->steps * sf->steps;
+    long n = 1;
+    int i;
 
-    double x, y, z;
-    for (i = 0; i < torus_points->lastcol; i++) {
-        x = torus_points->m[0][i];
-        y = torus_points->m[1][i];
-        z = torus_points->m[2][i];
-        add_edge(edges, x, y, z, x + 1, y + 1, z + 1);
+    if ( sf->steps < 1 )
+        return;
+    if ( sf->edges->cols < need )
+        grow_matrix(sf->edges, need);
+
+    if ( sf->steps * sf->steps >= PARALLEL_SURFACE_POINTS )
+        n = sysconf(_SC_NPROCESSORS_ONLN);
+    if ( n > 64 )
+        n = 64;
+    if ( n > sf->steps )
+        n = sf->steps;
+    if ( n < 1 )
+        n = 1;
+
+    for (i = 0; i < n; i++) {
+        parts[i] = *sf;
+        parts[i].i0 = 1 + sf->steps * i / n;
+        parts[i].i1 = 1 + sf->steps * (i + 1) / n;
     }
-    free_matrix(torus_points);
+    //a part whose thread can't be started is generated here instead
+    for (i = 1; i < n; i++)
+        started[i] = pthread_create(&threads[i], NULL, surface_rows, &parts[i]) == 0;
+    surface_rows(&parts[0]);
+    for (i = 1; i < n; i++)
+        if ( started[i] )
+            pthread_join(threads[i], NULL);
+        else
+            surface_rows(&parts[i]);
+
+    sf->edges->lastcol = need;
+}
+
+void add_sphere(struct matrix * edges, double cx, double cy, double cz, double r, int steps) {
+    struct surface sf = { edges, SURFACE_SPHERE, cx, cy, cz, r, 0, steps };
+    add_surface(&sf);
+}
+
+void add_torus(struct matrix * edges, double cx, double cy, double cz, double r1, double r2, int steps) {
+    struct surface sf = { edges, SURFACE_TORUS, cx, cy, cz, r1, r2, steps };
+    add_surface(&sf);
 }
 
 void add_circle(struct matrix * edges, double cx, double cy, double cz, double r, double step) {
@@ -122,7 +188,8 @@ void add_point( struct matrix * points, double x, double y, double z) {
     points->m[0][ points->lastcol ] = x;
     points->m[1][ points->lastcol ] = y;
     points->m[2][ points->lastcol ] = z;
-    points->m[3][ points->lastcol ] = 1;
+    if ( points->rows > 3 )
+        points->m[3][ points->lastcol ] = 1;
     points->lastcol++;
 } //end add_point
 
@@ -4,6 +4,16 @@
 #include "matrix.h"
 #include "ml6.h"
 
+/*
+  Sphere and torus step counts. A surface makes steps * steps
+  points (two columns each), so MAX_SURFACE_STEPS keeps one at
+  16 MB of doubles, and a script may make at most
+  MAX_SCRIPT_SURFACE_POINTS surface points in total.
+*/
+#define SURFACE_STEPS 50
+#define MAX_SURFACE_STEPS 500
+#define MAX_SCRIPT_SURFACE_POINTS 2000000
+
 void add_point( struct matrix * points, double x, double y, double z);
 void add_edge( struct matrix * points, 
 	       double x0, double y0, double z0, 
@@ -0,0 +1,154 @@
+/*====================== edgefile.c ========================
+  Saves and loads edge matrices in a compact binary format
+  (described in edgefile.h), so static geometry doesn't have
+  to be regenerated from script text on every run.
+
+  Loading into an empty edge matrix maps the file privately
+  and points the matrix rows straight at it: no parsing and no
+  copying. apply only dirties the pages it transforms, and the
+  file itself is never written. save_edges writes a temporary file
+  and renames it into place, so saving over a loaded file leaves
+  the old mapping intact. Another process truncating or rewriting
+  a loaded file in place still breaks the mapping (SIGBUS).
+  ==================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "matrix.h"
+#include "mesh.h"
+#include "edgefile.h"
+
+struct edge_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t rows;
+    uint32_t scalar_size;
+    uint32_t count;
+};
+
+/*
+  Writes edges plus every mesh instance, transformed, to file.
+*/
+int save_edges(char *file, struct matrix *edges, struct instances *inst) {
+    struct edge_header h;
+    char header[EDGE_FILE_HEADER];
+    char tmp[PATH_MAX];
+    struct matrix *flat;
+    FILE *f;
+    int fd, r, ok;
+
+    //edges may be mapped from file, so never truncate it in place
+    if ( snprintf(tmp, sizeof(tmp), "%s.XXXXXX", file) >= sizeof(tmp) ||
+         (fd = mkstemp(tmp)) < 0 ) {
+        printf("could not write %s\n", file);
+        return -1;
+    }
+    fchmod(fd, 0644);
+    f = fdopen(fd, "wb");
+    if ( f == NULL ) {
+        printf("could not write %s\n", file);
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+
+    flat = new_matrix(edges->rows, 4);
+    flatten_instances(inst, flat);
+
+    memcpy(h.magic, EDGE_FILE_MAGIC, 4);
+    h.version = EDGE_FILE_VERSION;
+    h.rows = edges->rows;
+    h.scalar_size = sizeof(scalar);
+    h.count = edges->lastcol + flat->lastcol;
+    memset(header, 0, sizeof(header));
+    memcpy(header, &h, sizeof(h));
+
+    ok = fwrite(header, sizeof(header), 1, f) == 1;
+    for (r = 0; r < edges->rows && ok; r++) {
+        ok = fwrite(edges->m[r], sizeof(scalar), edges->lastcol, f) == edges->lastcol;
+        if ( ok )
+            ok = fwrite(flat->m[r], sizeof(scalar), flat->lastcol, f) == flat->lastcol;
+    }
+    free_matrix(flat);
+
+    if ( fclose(f) != 0 || !ok || rename(tmp, file) < 0 ) {
+        printf("could not write %s\n", file);
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+  Appends the edges in file to edges. If edges is empty and the
+  file matches this build's layout, the rows are mapped in place;
+  otherwise the points are copied over, converting precision and
+  adding or dropping the w row as needed.
+*/
+int load_edges(char *file, struct matrix *edges) {
+    struct edge_header h;
+    struct stat st;
+    char *map, *data;
+    size_t row_bytes;
+    int fd, r, c;
+
+    fd = open(file, O_RDONLY);
+    if ( fd < 0 || fstat(fd, &st) < 0 || st.st_size < EDGE_FILE_HEADER ) {
+        printf("could not read %s\n", file);
+        if ( fd >= 0 )
+            close(fd);
+        return -1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if ( map == MAP_FAILED ) {
+        printf("could not map %s\n", file);
+        return -1;
+    }
+
+    memcpy(&h, map, sizeof(h));
+    row_bytes = (size_t)h.count * h.scalar_size;
+    if ( memcmp(h.magic, EDGE_FILE_MAGIC, 4) != 0 || h.version != EDGE_FILE_VERSION ||
+         (h.rows != 3 && h.rows != 4) || (h.scalar_size != 4 && h.scalar_size != 8) ||
+         (size_t)st.st_size < EDGE_FILE_HEADER + h.rows * row_bytes ) {
+        printf("%s is not a version %d edge file\n", file, EDGE_FILE_VERSION);
+        munmap(map, st.st_size);
+        return -1;
+    }
+    data = map + EDGE_FILE_HEADER;
+
+    if ( edges->lastcol == 0 && h.count > 0 &&
+         h.rows == edges->rows && h.scalar_size == sizeof(scalar) ) {
+        release_rows(edges);
+        for (r = 0; r < edges->rows; r++)
+            edges->m[r] = (scalar *)(data + r * row_bytes);
+        edges->cols = h.count;
+        edges->lastcol = h.count;
+        edges->map = map;
+        edges->maplen = st.st_size;
+        return 0;
+    }
+
+    if ( edges->cols < edges->lastcol + (int)h.count )
+        grow_matrix(edges, edges->lastcol + h.count);
+    for (r = 0; r < edges->rows; r++)
+        for (c = 0; c < h.count; c++) {
+            if ( r >= h.rows )
+                edges->m[r][edges->lastcol + c] = 1;
+            else if ( h.scalar_size == sizeof(float) )
+                edges->m[r][edges->lastcol + c] = ((float *)(data + r * row_bytes))[c];
+            else
+                edges->m[r][edges->lastcol + c] = ((double *)(data + r * row_bytes))[c];
+        }
+    edges->lastcol += h.count;
+    munmap(map, st.st_size);
+    return 0;
+}
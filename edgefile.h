@@ -0,0 +1,28 @@
+#ifndef EDGEFILE_H
+#define EDGEFILE_H
+
+#include "matrix.h"
+#include "mesh.h"
+
+/*
+  Binary edge file, in native byte order:
+
+    magic        "EDGS"
+    version      uint32, EDGE_FILE_VERSION
+    rows         uint32, 3 or 4 (4 when w is stored)
+    scalar_size  uint32, 4 for float, 8 for double
+    count        uint32, number of points (two per edge)
+    padding      up to EDGE_FILE_HEADER bytes
+
+  followed by rows arrays of count scalars each: every x,
+  then every y, then every z (and every w), exactly like
+  the rows of a struct matrix, so they can be mapped in place.
+*/
+#define EDGE_FILE_MAGIC "EDGS"
+#define EDGE_FILE_VERSION 1
+#define EDGE_FILE_HEADER 64
+
+int save_edges(char *file, struct matrix *edges, struct instances *inst);
+int load_edges(char *file, struct matrix *edges);
+
+#endif
@@ -6,23 +6,73 @@
 #include "display.h"
 #include "draw.h"
 #include "matrix.h"
+#include "mesh.h"
 #include "parser.h"
+#include "batch.h"
+#include "server.h"
 
+/*
+  main                          read a script from stdin
+  main script                   render one script
+  main [-j n] script script...  render many scripts on n threads
+  main [-j n] -m manifest       render every script listed in manifest
+  main [-j n] -s socket         serve scripts on a Unix socket
+*/
 int main(int argc, char **argv) {
 
     screen s;
     struct matrix * edges;
     struct matrix * transform;
+    struct instances * instances;
+    char **files;
+    char *manifest = NULL;
+    char *sock_path = NULL;
+    int threads = default_threads();
+    int count, status, i;
 
-    edges = new_matrix(4, 4);
+    if ( argc > 2 || (argc == 2 && argv[1][0] == '-') ) {
+        for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+            if ( strcmp(argv[i], "-j") == 0 && i + 1 < argc )
+                threads = atoi(argv[++i]);
+            else if ( strcmp(argv[i], "-m") == 0 && i + 1 < argc )
+                manifest = argv[++i];
+            else if ( strcmp(argv[i], "-s") == 0 && i + 1 < argc )
+                sock_path = argv[++i];
+            else {
+                printf("usage: %s [-j threads] [-s socket | -m manifest | script...]\n", argv[0]);
+                return 2;
+            }
+        }
+
+        if ( sock_path )
+            return run_server(sock_path, threads) ? 1 : 0;
+        if ( manifest ) {
+            files = read_manifest(manifest, &count);
+            if ( files == NULL ) {
+                printf("could not read manifest %s\n", manifest);
+                return 1;
+            }
+            status = run_batch(files, count, threads);
+            free_manifest(files, count);
+        } else
+            status = run_batch(argv + i, argc - i, threads);
+        free_mesh_cache();
+        return status ? 1 : 0;
+    }
+
+    edges = new_matrix(POINT_ROWS, 4);
     transform = new_matrix(4, 4);
+    instances = new_instances();
 
     if ( argc == 2 )
-        parse_file( argv[1], transform, edges, s );
+        status = parse_file( argv[1], transform, edges, instances, s );
     else
-        parse_file( "stdin", transform, edges, s );
+        status = parse_file( "stdin", transform, edges, instances, s );
 
 
     free_matrix( edges );
     free_matrix( transform );
-}  
+    free_instances( instances );
+    free_mesh_cache();
+    return status ? 1 : 0;
+}
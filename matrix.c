@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <string.h>
+#include <sys/mman.h>
 
 #include "matrix.h"
 
@@ -147,34 +149,67 @@ void ident(struct matrix *m) {
 }//end ident
 
 
-void matrix_mult(struct matrix *a, struct matrix *b) {
-    int r, c;
-    struct matrix *tmp;
-    tmp = new_matrix(4, 1);
-
-    for (c=0; c < b->lastcol; c++) {
-
-        //copy current col (point) to tmp
-        for (r=0; r < b->rows; r++)      
-            tmp->m[r][0] = b->m[r][c];
+/*
+  Point matrices with and without a w row get their own loops,
+  with no branches and no aliasing between rows, so the compiler
+  can vectorize across columns.
+*/
+static void mult_rows3(scalar **a, scalar * restrict x, scalar * restrict y,
+                       scalar * restrict z, int cols) {
+    scalar a00 = a[0][0], a01 = a[0][1], a02 = a[0][2], a03 = a[0][3];
+    scalar a10 = a[1][0], a11 = a[1][1], a12 = a[1][2], a13 = a[1][3];
+    scalar a20 = a[2][0], a21 = a[2][1], a22 = a[2][2], a23 = a[2][3];
+    scalar px, py, pz;
+    int c;
+
+    //w is implied to be 1
+    for (c=0; c < cols; c++) {
+        px = x[c];
+        py = y[c];
+        pz = z[c];
+        x[c] = a00 * px + a01 * py + a02 * pz + a03;
+        y[c] = a10 * px + a11 * py + a12 * pz + a13;
+        z[c] = a20 * px + a21 * py + a22 * pz + a23;
+    }
+}
 
-        for (r=0; r < b->rows; r++) 
-            b->m[r][c] = a->m[r][0] * tmp->m[0][0] +
-                a->m[r][1] * tmp->m[1][0] +
-                a->m[r][2] * tmp->m[2][0] +
-                a->m[r][3] * tmp->m[3][0];
+static void mult_rows4(scalar **a, scalar * restrict x, scalar * restrict y,
+                       scalar * restrict z, scalar * restrict w, int cols) {
+    scalar a00 = a[0][0], a01 = a[0][1], a02 = a[0][2], a03 = a[0][3];
+    scalar a10 = a[1][0], a11 = a[1][1], a12 = a[1][2], a13 = a[1][3];
+    scalar a20 = a[2][0], a21 = a[2][1], a22 = a[2][2], a23 = a[2][3];
+    scalar a30 = a[3][0], a31 = a[3][1], a32 = a[3][2], a33 = a[3][3];
+    scalar px, py, pz, pw;
+    int c;
+
+    for (c=0; c < cols; c++) {
+        px = x[c];
+        py = y[c];
+        pz = z[c];
+        pw = w[c];
+        x[c] = a00 * px + a01 * py + a02 * pz + a03 * pw;
+        y[c] = a10 * px + a11 * py + a12 * pz + a13 * pw;
+        z[c] = a20 * px + a21 * py + a22 * pz + a23 * pw;
+        w[c] = a30 * px + a31 * py + a32 * pz + a33 * pw;
     }
-    free_matrix(tmp);
+}
+
+void matrix_mult(struct matrix *a, struct matrix *b) {
+    //b may be a 3 row point matrix with an implied w of 1
+    if ( b->rows == 3 )
+        mult_rows3(a->m, b->m[0], b->m[1], b->m[2], b->lastcol);
+    else
+        mult_rows4(a->m, b->m[0], b->m[1], b->m[2], b->m[3], b->lastcol);
 }//end matrix_mult
 
 struct matrix *new_matrix(int rows, int cols) {
-    double **tmp;
+    scalar **tmp;
     int i;
     struct matrix *m;
 
-    tmp = (double **)malloc(rows * sizeof(double *));
+    tmp = (scalar **)malloc(rows * sizeof(scalar *));
     for (i=0;i<rows;i++) {
-        tmp[i]=(double *)malloc(cols * sizeof(double));
+        tmp[i]=(scalar *)malloc(cols * sizeof(scalar));
     }
 
     m=(struct matrix *)malloc(sizeof(struct matrix));
@@ -182,25 +217,58 @@ struct matrix *new_matrix(int rows, int cols) {
     m->rows = rows;
     m->cols = cols;
     m->lastcol = 0;
+    m->map = NULL;
+    m->maplen = 0;
 
     return m;
 }
 
 void free_matrix(struct matrix *m) {
 
-    int i;
-    for (i=0;i<m->rows;i++) {
-        free(m->m[i]);
-    }
+    release_rows(m);
     free(m->m);
     free(m);
 }
 
+/*
+  Frees or unmaps the rows of m, leaving m->m itself
+  for the caller to refill.
+*/
+void release_rows(struct matrix *m) {
+
+    int i;
+    if ( m->map ) {
+        munmap(m->map, m->maplen);
+        m->map = NULL;
+        m->maplen = 0;
+    }
+    else
+        for (i=0;i<m->rows;i++) {
+            free(m->m[i]);
+        }
+}
+
 void grow_matrix(struct matrix *m, int newcols) {
 
     int i;
+    scalar *row;
+
+    //mapped rows can't be realloced, so move them to the heap first
+    if ( m->map ) {
+        for (i=0;i<m->rows;i++) {
+            row = (scalar *)malloc(newcols*sizeof(scalar));
+            memcpy(row, m->m[i], (m->cols < newcols ? m->cols : newcols)*sizeof(scalar));
+            m->m[i] = row;
+        }
+        munmap(m->map, m->maplen);
+        m->map = NULL;
+        m->maplen = 0;
+        m->cols = newcols;
+        return;
+    }
+
     for (i=0;i<m->rows;i++) {
-        m->m[i] = realloc(m->m[i],newcols*sizeof(double));
+        m->m[i] = realloc(m->m[i],newcols*sizeof(scalar));
     }
     m->cols = newcols;
 }
@@ -4,10 +4,32 @@
 #define HERMITE 0
 #define BEZIER 1
 
+/*
+  Building with -DSINGLE_PRECISION stores every matrix as floats and
+  drops the homogeneous w row from point matrices, since w is always 1
+  for geometry. Transform matrices stay 4x4; matrix_mult treats a
+  missing w row as 1.
+*/
+#ifdef SINGLE_PRECISION
+typedef float scalar;
+#define POINT_ROWS 3
+#else
+typedef double scalar;
+#define POINT_ROWS 4
+#endif
+
+#include <stddef.h>
+
+/*
+  If map is set, the rows point into a private file mapping of
+  maplen bytes (see load_edges) instead of separate mallocs.
+*/
 struct matrix {
-  double **m;
+  scalar **m;
   int rows, cols;
   int lastcol;
+  void *map;
+  size_t maplen;
 } matrix;
 
 
@@ -21,6 +43,7 @@ struct matrix * make_rotZ(double theta);
 //Basic matrix manipulation routines
 struct matrix *new_matrix(int rows, int cols);
 void free_matrix(struct matrix *m);
+void release_rows(struct matrix *m);
 void grow_matrix(struct matrix *m, int newcols);
 void copy_matrix(struct matrix *a, struct matrix *b);
 void print_matrix(struct matrix *m);
@@ -0,0 +1,355 @@
+/*====================== mesh.c ========================
+  Cache of tessellated primitives and the instanced draw path.
+
+  A box, sphere or torus is generated once per unique set of
+  parameters and kept in a cache shared by all threads. When the
+  cache grows past MESH_CACHE_MAX, the least recently used meshes
+  that no instance holds are freed. Scripts
+  place instances of cached meshes; apply only updates each
+  instance's transform and draw_instances transforms points on
+  the way to draw_line, so no mesh is ever copied into edges.
+  ==================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "ml6.h"
+#include "draw.h"
+#include "matrix.h"
+#include "mesh.h"
+#include "optimize.h"
+
+#define MESH_BUCKETS 256
+#define MESH_CACHE_MAX 256
+
+static struct mesh *cache[MESH_BUCKETS];
+static int cache_count = 0;
+//most and least recently used ends of the lru list
+static struct mesh *newest = NULL, *oldest = NULL;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int mesh_hash(int type, double *params, int steps, double weld) {
+    unsigned int h = 2166136261u;
+    unsigned char *p = (unsigned char *)params;
+    unsigned char *w = (unsigned char *)&weld;
+    int i;
+
+    h = (h ^ type) * 16777619u;
+    h = (h ^ steps) * 16777619u;
+    for (i = 0; i < MESH_PARAMS * sizeof(double); i++)
+        h = (h ^ p[i]) * 16777619u;
+    for (i = 0; i < sizeof(double); i++)
+        h = (h ^ w[i]) * 16777619u;
+    return h % MESH_BUCKETS;
+}
+
+static struct mesh * find_mesh(unsigned int bucket, int type, double *params, int steps, double weld) {
+    struct mesh *m;
+    for (m = cache[bucket]; m; m = m->next)
+        if ( m->type == type && m->steps == steps && m->weld == weld &&
+             memcmp(m->params, params, sizeof(m->params)) == 0 )
+            return m;
+    return NULL;
+}
+
+static struct mesh * build_mesh(int type, double *params, int steps, double weld) {
+    struct mesh *m = (struct mesh *)malloc(sizeof(struct mesh));
+    double *p = params;
+
+    m->type = type;
+    memcpy(m->params, params, sizeof(m->params));
+    m->steps = steps;
+    m->weld = weld;
+    m->refs = 0;
+    m->next = NULL;
+    m->newer = NULL;
+    m->older = NULL;
+    m->points = new_matrix(POINT_ROWS, 4);
+
+    if ( type == MESH_BOX )
+        add_box(m->points, p[0], p[1], p[2], p[3], p[4], p[5]);
+    else if ( type == MESH_SPHERE )
+        add_sphere(m->points, p[0], p[1], p[2], p[3], steps);
+    else
+        add_torus(m->points, p[0], p[1], p[2], p[3], p[4], steps);
+
+    if ( weld > 0 )
+        optimize_edges(m->points, weld);
+    return m;
+}
+
+static void free_mesh(struct mesh *m) {
+    free_matrix(m->points);
+    free(m);
+}
+
+static void lru_unlink(struct mesh *m) {
+    if ( m->newer )
+        m->newer->older = m->older;
+    else
+        newest = m->older;
+    if ( m->older )
+        m->older->newer = m->newer;
+    else
+        oldest = m->newer;
+    m->newer = m->older = NULL;
+}
+
+static void lru_push(struct mesh *m) {
+    m->older = newest;
+    m->newer = NULL;
+    if ( newest )
+        newest->newer = m;
+    newest = m;
+    if ( oldest == NULL )
+        oldest = m;
+}
+
+static void bucket_remove(struct mesh *m) {
+    struct mesh **p = &cache[mesh_hash(m->type, m->params, m->steps, m->weld)];
+    while ( *p != m )
+        p = &(*p)->next;
+    *p = m->next;
+}
+
+//frees unused meshes, oldest first, until the cache fits
+static void evict_meshes() {
+    struct mesh *m, *newer;
+
+    for (m = oldest; m && cache_count > MESH_CACHE_MAX; m = newer) {
+        newer = m->newer;
+        if ( m->refs > 0 )
+            continue;
+        bucket_remove(m);
+        lru_unlink(m);
+        free_mesh(m);
+        cache_count--;
+    }
+}
+
+//takes a reference and marks m most recently used; lock held
+static struct mesh * use_mesh(struct mesh *m) {
+    m->refs++;
+    lru_unlink(m);
+    lru_push(m);
+    return m;
+}
+
+/*
+  Returns the mesh for a primitive, building it on first use,
+  with a reference held for the caller (see release_mesh).
+  params holds the primitive's arguments in the order the script
+  gives them, with unused slots zeroed. If weld is positive, the
+  mesh is run through optimize_edges with it as epsilon once, when
+  it is built; welded and unwelded meshes are cached apart.
+  Generation happens outside
+  the lock; if two threads race, the loser's copy is dropped.
+*/
+struct mesh * get_mesh(int type, double *params, int steps, double weld) {
+    unsigned int bucket = mesh_hash(type, params, steps, weld);
+    struct mesh *m, *built;
+
+    pthread_mutex_lock(&cache_lock);
+    m = find_mesh(bucket, type, params, steps, weld);
+    if ( m )
+        use_mesh(m);
+    pthread_mutex_unlock(&cache_lock);
+    if ( m )
+        return m;
+
+    built = build_mesh(type, params, steps, weld);
+
+    pthread_mutex_lock(&cache_lock);
+    m = find_mesh(bucket, type, params, steps, weld);
+    if ( m == NULL ) {
+        m = built;
+        built = NULL;
+        m->next = cache[bucket];
+        cache[bucket] = m;
+        cache_count++;
+    }
+    use_mesh(m);
+    evict_meshes();
+    pthread_mutex_unlock(&cache_lock);
+
+    if ( built )
+        free_mesh(built);
+    return m;
+}
+
+void release_mesh(struct mesh *m) {
+    pthread_mutex_lock(&cache_lock);
+    m->refs--;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void free_mesh_cache() {
+    struct mesh *m, *next;
+    int i;
+
+    pthread_mutex_lock(&cache_lock);
+    for (i = 0; i < MESH_BUCKETS; i++) {
+        for (m = cache[i]; m; m = next) {
+            next = m->next;
+            free_mesh(m);
+        }
+        cache[i] = NULL;
+    }
+    cache_count = 0;
+    newest = oldest = NULL;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+struct instances * new_instances() {
+    struct instances *inst;
+
+    inst = (struct instances *)malloc(sizeof(struct instances));
+    inst->size = 16;
+    inst->count = 0;
+    inst->list = (struct instance *)calloc(inst->size, sizeof(struct instance));
+    return inst;
+}
+
+void free_instances(struct instances *inst) {
+    int i;
+
+    clear_instances(inst);
+    for (i = 0; i < inst->size; i++)
+        if ( inst->list[i].transform )
+            free_matrix(inst->list[i].transform);
+    free(inst->list);
+    free(inst);
+}
+
+/*
+  Drops every instance but keeps their transform matrices
+  around for the next ones.
+*/
+void clear_instances(struct instances *inst) {
+    int i;
+
+    for (i = 0; i < inst->count; i++)
+        release_mesh(inst->list[i].mesh);
+    inst->count = 0;
+}
+
+void add_instance(struct instances *inst, struct mesh *mesh) {
+    struct instance *i;
+
+    if ( inst->count == inst->size ) {
+        inst->list = realloc(inst->list, 2 * inst->size * sizeof(struct instance));
+        memset(inst->list + inst->size, 0, inst->size * sizeof(struct instance));
+        inst->size *= 2;
+    }
+
+    i = &inst->list[inst->count++];
+    i->mesh = mesh;
+    if ( i->transform == NULL )
+        i->transform = new_matrix(4, 4);
+    i->transform->lastcol = 0;
+}
+
+/*
+  Records transform on every instance. The transforms are kept
+  in order rather than multiplied together, so points come out
+  rounded exactly as if apply had transformed them in edges.
+*/
+void apply_instances(struct matrix *transform, struct instances *inst) {
+    struct matrix *t;
+    int i, r, c;
+
+    for (i = 0; i < inst->count; i++) {
+        t = inst->list[i].transform;
+        if ( t->cols < t->lastcol + 4 )
+            grow_matrix(t, 2 * t->cols);
+        for (r = 0; r < 4; r++)
+            for (c = 0; c < 4; c++)
+                t->m[r][t->lastcol + c] = transform->m[r][c];
+        t->lastcol += 4;
+    }
+}
+
+/*
+  Runs one mesh point through every transform applied to its
+  instance, in the same order and with the same rounding as
+  matrix_mult. Mesh points always have w = 1, and so do their
+  images under the affine transforms scripts can build.
+*/
+static void transform_point(struct matrix *transform, scalar *x, scalar *y, scalar *z) {
+    scalar **t = transform->m;
+    scalar px, py, pz;
+    int k;
+
+    for (k = 0; k < transform->lastcol; k += 4) {
+        px = *x;
+        py = *y;
+        pz = *z;
+        *x = t[0][k] * px + t[0][k + 1] * py + t[0][k + 2] * pz + t[0][k + 3];
+        *y = t[1][k] * px + t[1][k + 1] * py + t[1][k + 2] * pz + t[1][k + 3];
+        *z = t[2][k] * px + t[2][k + 1] * py + t[2][k + 2] * pz + t[2][k + 3];
+    }
+}
+
+/*
+  Same as transforming each mesh into edges and calling
+  draw_lines, without touching the mesh.
+*/
+void draw_instances(struct instances *inst, screen s, color c) {
+    struct matrix *points, *t;
+    scalar x0, y0, z0, x1, y1, z1;
+    int i, point;
+
+    for (i = 0; i < inst->count; i++) {
+        points = inst->list[i].mesh->points;
+        t = inst->list[i].transform;
+
+        for (point = 0; point < points->lastcol - 1; point += 2) {
+            x0 = points->m[0][point];
+            y0 = points->m[1][point];
+            z0 = points->m[2][point];
+            transform_point(t, &x0, &y0, &z0);
+
+            x1 = points->m[0][point + 1];
+            y1 = points->m[1][point + 1];
+            z1 = points->m[2][point + 1];
+            transform_point(t, &x1, &y1, &z1);
+
+            draw_line(x0, y0, x1, y1, s, c);
+        }
+    }
+}
+
+/*
+  Appends every instance's points, transformed, to edges.
+  Used where real edge data is needed, like save_edges.
+*/
+void flatten_instances(struct instances *inst, struct matrix *edges) {
+    struct matrix *points;
+    scalar x, y, z;
+    int i, point, need;
+
+    need = edges->lastcol;
+    for (i = 0; i < inst->count; i++)
+        need += inst->list[i].mesh->points->lastcol;
+    if ( edges->cols < need )
+        grow_matrix(edges, need);
+
+    for (i = 0; i < inst->count; i++) {
+        points = inst->list[i].mesh->points;
+
+        for (point = 0; point < points->lastcol; point++) {
+            x = points->m[0][point];
+            y = points->m[1][point];
+            z = points->m[2][point];
+            transform_point(inst->list[i].transform, &x, &y, &z);
+            edges->m[0][edges->lastcol] = x;
+            edges->m[1][edges->lastcol] = y;
+            edges->m[2][edges->lastcol] = z;
+            if ( edges->rows > 3 )
+                edges->m[3][edges->lastcol] = 1;
+            edges->lastcol++;
+        }
+    }
+}
@@ -0,0 +1,58 @@
+#ifndef MESH_H
+#define MESH_H
+
+#include "matrix.h"
+#include "ml6.h"
+
+#define MESH_BOX 0
+#define MESH_SPHERE 1
+#define MESH_TORUS 2
+
+#define MESH_PARAMS 6
+
+/*
+  A tessellated primitive. Meshes are shared between every
+  instance (and thread) that asks for the same parameters, so
+  their points must never be modified once built. refs counts
+  the instances using a mesh; only unused meshes are evicted.
+*/
+struct mesh {
+  int type;
+  double params[MESH_PARAMS];
+  int steps;
+  double weld;
+  int refs;
+  struct matrix *points;
+  struct mesh *next;
+  struct mesh *newer, *older;
+};
+
+/*
+  One placement of a mesh, holding a reference to it. transform
+  holds every apply made since the instance was added, as 4x4
+  blocks side by side (4 columns each), in place of transforming
+  points.
+*/
+struct instance {
+  struct mesh *mesh;
+  struct matrix *transform;
+};
+
+struct instances {
+  struct instance *list;
+  int count, size;
+};
+
+struct mesh * get_mesh(int type, double *params, int steps, double weld);
+void release_mesh(struct mesh *m);
+void free_mesh_cache();
+
+struct instances * new_instances();
+void free_instances(struct instances *inst);
+void clear_instances(struct instances *inst);
+void add_instance(struct instances *inst, struct mesh *mesh);
+void apply_instances(struct matrix *transform, struct instances *inst);
+void draw_instances(struct instances *inst, screen s, color c);
+void flatten_instances(struct instances *inst, struct matrix *edges);
+
+#endif
@@ -0,0 +1,210 @@
+/*====================== optimize.c ========================
+  Shrinks an edge matrix without changing what it draws.
+
+  Points closer than epsilon are welded together using a spatial
+  hash with cells epsilon wide, so only the 27 cells around a
+  point need to be searched. Edges are then compared by their
+  welded endpoints, and repeats of an earlier edge (in either
+  direction) are dropped. An edge whose ends weld into one point
+  still draws a pixel, so it is only dropped when a kept edge
+  already ends on that point.
+  ==================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "matrix.h"
+#include "optimize.h"
+
+struct cell {
+    double x, y, z;
+    int head;
+};
+
+struct welder {
+    struct cell *cells;
+    int *next;
+    unsigned int mask;
+    double epsilon;
+};
+
+static unsigned int table_size(int count) {
+    unsigned int size = 16;
+    while ( size < 2 * (unsigned int)count )
+        size <<= 1;
+    return size;
+}
+
+static unsigned int hash_cell(double x, double y, double z) {
+    uint64_t b[3];
+    uint64_t h = 1469598103934665603ull;
+    int i;
+
+    //+0.0 folds -0.0 into 0.0 so both hit the same cell
+    x += 0.0;
+    y += 0.0;
+    z += 0.0;
+    memcpy(&b[0], &x, 8);
+    memcpy(&b[1], &y, 8);
+    memcpy(&b[2], &z, 8);
+    for (i = 0; i < 3; i++)
+        h = (h ^ b[i]) * 1099511628211ull;
+    return h ^ (h >> 32);
+}
+
+static struct cell * find_cell(struct welder *w, double x, double y, double z, int insert) {
+    unsigned int i = hash_cell(x, y, z) & w->mask;
+
+    while ( w->cells[i].head >= 0 ) {
+        if ( w->cells[i].x == x && w->cells[i].y == y && w->cells[i].z == z )
+            return &w->cells[i];
+        i = (i + 1) & w->mask;
+    }
+    if ( !insert )
+        return NULL;
+    w->cells[i].x = x;
+    w->cells[i].y = y;
+    w->cells[i].z = z;
+    return &w->cells[i];
+}
+
+/*
+  Returns the welded point for column p: an earlier representative
+  within epsilon, or p itself, which then becomes a representative.
+*/
+static int weld_point(struct welder *w, struct matrix *m, int p) {
+    double x = m->m[0][p], y = m->m[1][p], z = m->m[2][p];
+    double cx = floor(x / w->epsilon);
+    double cy = floor(y / w->epsilon);
+    double cz = floor(z / w->epsilon);
+    double dx, dy, dz;
+    struct cell *c;
+    int i, j, k, q;
+
+    for (i = -1; i <= 1; i++)
+        for (j = -1; j <= 1; j++)
+            for (k = -1; k <= 1; k++) {
+                c = find_cell(w, cx + i, cy + j, cz + k, 0);
+                if ( c == NULL )
+                    continue;
+                for (q = c->head; q >= 0; q = w->next[q]) {
+                    dx = m->m[0][q] - x;
+                    dy = m->m[1][q] - y;
+                    dz = m->m[2][q] - z;
+                    if ( dx * dx + dy * dy + dz * dz <= w->epsilon * w->epsilon )
+                        return q;
+                }
+            }
+
+    c = find_cell(w, cx, cy, cz, 1);
+    w->next[p] = c->head;
+    c->head = p;
+    return p;
+}
+
+static int seen_edge(uint64_t *set, unsigned int mask, uint64_t key) {
+    unsigned int i = (key ^ (key >> 29)) * 2654435761u & mask;
+
+    while ( set[i] != UINT64_MAX ) {
+        if ( set[i] == key )
+            return 1;
+        i = (i + 1) & mask;
+    }
+    set[i] = key;
+    return 0;
+}
+
+/*
+  Welds points within epsilon and removes duplicate edges and
+  degenerate edges another edge covers, keeping the order of
+  the ones left.
+  Returns how many edges were removed.
+*/
+int optimize_edges(struct matrix *edges, double epsilon) {
+    struct welder w;
+    uint64_t *set;
+    unsigned int size, set_mask;
+    int *id;
+    char *keep, *used;
+    int count = edges->lastcol;
+    int pairs = count / 2;
+    int e, p, r, a, b, kept;
+
+    if ( pairs == 0 || epsilon <= 0 )
+        return 0;
+
+    size = table_size(count);
+    w.cells = (struct cell *)malloc(size * sizeof(struct cell));
+    for (p = 0; p < size; p++)
+        w.cells[p].head = -1;
+    w.next = (int *)malloc(count * sizeof(int));
+    w.mask = size - 1;
+    w.epsilon = epsilon;
+
+    id = (int *)malloc(count * sizeof(int));
+    for (p = 0; p < count; p++)
+        id[p] = weld_point(&w, edges, p);
+
+    //representatives come first and never move, so snap in one pass
+    for (p = 0; p < count; p++)
+        if ( id[p] != p )
+            for (r = 0; r < edges->rows; r++)
+                edges->m[r][p] = edges->m[r][id[p]];
+
+    size = table_size(pairs);
+    set = (uint64_t *)malloc(size * sizeof(uint64_t));
+    memset(set, 0xff, size * sizeof(uint64_t));
+    set_mask = size - 1;
+    keep = (char *)calloc(pairs, 1);
+    used = (char *)calloc(count, 1);
+
+    //first the real edges, marking the points they draw
+    for (e = 0; e < pairs; e++) {
+        a = id[2 * e];
+        b = id[2 * e + 1];
+        if ( a == b )
+            continue;
+        if ( seen_edge(set, set_mask, a < b ? (uint64_t)a << 32 | b : (uint64_t)b << 32 | a) )
+            continue;
+        keep[e] = 1;
+        used[a] = used[b] = 1;
+    }
+
+    //a degenerate edge still plots its pixel, unless a kept edge ends there
+    for (e = 0; e < pairs; e++) {
+        a = id[2 * e];
+        if ( a != id[2 * e + 1] || used[a] )
+            continue;
+        if ( seen_edge(set, set_mask, (uint64_t)a << 32 | a) )
+            continue;
+        keep[e] = 1;
+    }
+
+    kept = 0;
+    for (e = 0; e < pairs; e++) {
+        if ( !keep[e] )
+            continue;
+        for (r = 0; r < edges->rows; r++) {
+            edges->m[r][2 * kept] = edges->m[r][2 * e];
+            edges->m[r][2 * kept + 1] = edges->m[r][2 * e + 1];
+        }
+        kept++;
+    }
+
+    //a trailing unpaired point is kept as is
+    if ( count % 2 )
+        for (r = 0; r < edges->rows; r++)
+            edges->m[r][2 * kept] = edges->m[r][count - 1];
+    edges->lastcol = 2 * kept + count % 2;
+
+    free(used);
+    free(keep);
+    free(set);
+    free(id);
+    free(w.next);
+    free(w.cells);
+    return pairs - kept;
+}
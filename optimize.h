@@ -0,0 +1,8 @@
+#ifndef OPTIMIZE_H
+#define OPTIMIZE_H
+
+#include "matrix.h"
+
+int optimize_edges(struct matrix *edges, double epsilon);
+
+#endif
@@ -7,16 +7,94 @@
 #include "display.h"
 #include "draw.h"
 #include "matrix.h"
+#include "mesh.h"
+#include "edgefile.h"
+#include "optimize.h"
 #include "parser.h"
 
+//scripts from the socket server may not touch files or start a viewer
+static __thread int untrusted = 0;
 
-void parse_file ( char * filename, 
+void set_untrusted_scripts( int on) {
+    untrusted = on;
+}
+
+//strips the newline fgets leaves, if there is one
+static void chomp( char *s) {
+    int len = strlen(s);
+    if ( len > 0 && s[len - 1] == '\n' )
+        s[len - 1] = '\0';
+}
+
+static int read_params( char *params, FILE *f) {
+    if ( fgets(params, 255, f) == NULL )
+        return -1;
+    chomp(params);
+    return 0;
+}
+
+static int missing_params( char *command) {
+    printf("missing parameters for %s\n", command);
+    return -1;
+}
+
+static int bad_params( char *command, char *params) {
+    printf("bad parameters for %s: %s\n", command, params);
+    return -1;
+}
+
+//charges a surface's points to the script, failing once it is over budget
+static int take_surface_points( char *command, long *used, int steps) {
+    if ( *used + (long)steps * steps > MAX_SCRIPT_SURFACE_POINTS ) {
+        printf("%s would go over %d surface points\n", command, MAX_SCRIPT_SURFACE_POINTS);
+        return -1;
+    }
+    *used += (long)steps * steps;
+    return 0;
+}
+
+static int not_allowed( char *command) {
+    printf("%s is not allowed in untrusted scripts\n", command);
+    return -1;
+}
+
+int parse_file ( char * filename, 
         struct matrix * transform, 
         struct matrix * edges,
+        struct instances * instances,
         screen s) {
 
     FILE *f;
+    int status;
+
+    if ( strcmp(filename, "stdin") == 0 ) {
+        f = stdin;
+        printf("> ");
+    } else
+        f = fopen(filename, "r");
+
+    if ( f == NULL ) {
+        printf("could not open %s\n", filename);
+        return -1;
+    }
+
+    status = parse_stream(f, transform, edges, instances, s);
+    if ( f != stdin )
+        fclose(f);
+    return status;
+}
+
+int parse_stream ( FILE * f, 
+        struct matrix * transform, 
+        struct matrix * edges,
+        struct instances * instances,
+        screen s) {
+
     char line[256];
+    int status = 0;
+    long surface_points = 0;
+    //epsilon new meshes are welded with, 0 for no welding
+    double weld = 0;
     clear_screen(s);
 
     color c;
@@ -24,147 +102,302 @@ void parse_file ( char * filename,
     c.green = 255;
     c.blue = 255;
 
-    if ( strcmp(filename, "stdin") == 0 ) {
-        f = stdin;
-        printf("> ");
-    } else
-        f = fopen(filename, "r");
-
     ident(transform);
+    edges->lastcol = 0;
+    clear_instances(instances);
 
     while ( fgets(line, 255, f) != NULL ) {
-        line[strlen(line) - 1] = '\0';
+        chomp(line);
         //printf(":%s:\n", line);
         char params[256];
         if (strcmp(line, "line") == 0) {
-            fgets(params, 255, f);
-            params[strlen(params) - 1] = '\0';
+            if ( read_params(params, f) ) {
+                status = missing_params(line);
+                break;
+            }
             //printf(":%s:\n", params);
             int x1, y1, z1, x2, y2, z2;
-            sscanf(params, "%d %d %d %d %d %d", &x1, &y1, &z1, &x2, &y2, &z2); 
-            printf("line from %d %d %d to %d %d %d\n", x1, y1, z1, x2, y2, z2);
-            add_edge(edges, x1, y1, z1, x2, y2, z2);
+            if ( sscanf(params, "%d %d %d %d %d %d", &x1, &y1, &z1, &x2, &y2, &z2) < 6 ) {
+                status = bad_params(line, params);
+            } else {
+                printf("line from %d %d %d to %d %d %d\n", x1, y1, z1, x2, y2, z2);
+                add_edge(edges, x1, y1, z1, x2, y2, z2);
+            }
         } else if (strcmp(line, "ident") == 0) {
             printf("reverting transformation matrix to identity matrix\n");
-            free_matrix(transform);
-            transform = new_matrix(4, 4);
             ident(transform);
         } else if (strcmp(line, "scale") == 0) {
-            fgets(params, 255, f);
-            params[strlen(params) - 1] = '\0';
+            if ( read_params(params, f) ) {
+                status = missing_params(line);
+                break;
+            }
             //printf(":%s:\n", params);
             double sx, sy, sz;
-            sscanf(params, "%lf %lf %lf", &sx, &sy, &sz); 
-            printf("scale by %lf %lf %lf\n", sx, sy, sz);
-            struct matrix * scale_matrix = make_scale(sx, sy, sz);
-            matrix_mult(scale_matrix, transform);
-            free_matrix(scale_matrix);
+            if ( sscanf(params, "%lf %lf %lf", &sx, &sy, &sz) < 3 ) {
+                status = bad_params(line, params);
+            } else {
+                printf("scale by %lf %lf %lf\n", sx, sy, sz);
+                struct matrix * scale_matrix = make_scale(sx, sy, sz);
+                matrix_mult(scale_matrix, transform);
+                free_matrix(scale_matrix);
+            }
         } else if (strcmp(line, "move") == 0) {
-            fgets(params, 255, f);
-            params[strlen(params) - 1] = '\0';
+            if ( read_params(params, f) ) {
+                status = missing_params(line);
+                break;
+            }
             //printf(":%s:\n", params);
             int tx, ty, tz;
-            sscanf(params, "%d %d %d", &tx, &ty, &tz); 
-            printf("translate by %d %d %d\n", tx, ty, tz);
-            struct matrix * transation_matrix = make_translate(tx, ty, tz);
-            matrix_mult(transation_matrix, transform);
-            free_matrix(transation_matrix);
+            if ( sscanf(params, "%d %d %d", &tx, &ty, &tz) < 3 ) {
+                status = bad_params(line, params);
+            } else {
+                printf("translate by %d %d %d\n", tx, ty, tz);
+                struct matrix * transation_matrix = make_translate(tx, ty, tz);
+                matrix_mult(transation_matrix, transform);
+                free_matrix(transation_matrix);
+            }
         } else if (strcmp(line, "color") == 0) {
-            fgets(params, 255, f);
-            params[strlen(params) - 1] = '\0';
+            if ( read_params(params, f) ) {
+                status = missing_params(line);
+                break;
+            }
             //printf(":%s:\n", params);
             int r, g, b;
-            sscanf(params, "%d %d %d", &r, &g, &b); 
-            printf("changing color to %d %d %d\n", r, g, b);
-            c.red = r;
-            c.green = g;
-            c.blue = b;
+            if ( sscanf(params, "%d %d %d", &r, &g, &b) < 3 ) {
+                status = bad_params(line, params);
+            } else {
+                printf("changing color to %d %d %d\n", r, g, b);
+                c.red = r;
+                c.green = g;
+                c.blue = b;
+            }
         } else if (strcmp(line, "rotate") == 0) {
-            fgets(params, 255, f);
-            params[strlen(params) - 1] = '\0';
+            if ( read_params(params, f) ) {
+                status = missing_params(line);
+                break;
+            }
             //printf(":%s:\n", params);
             char axis;
             int theta;
-            sscanf(params, "%c %d", &axis, &theta); 
-            printf("rotating %c axis by %d degrees\n", axis, theta);
-            struct matrix * rotation_matrix;
-            if (axis == 'x') {
-                rotation_matrix = make_rotX(theta);
-            } else if (axis == 'y') {
-                rotation_matrix = make_rotY(theta);
-            } else if (axis == 'z') {
-                rotation_matrix = make_rotZ(theta);
-            } else {
-                printf("invalid rotation axis\n");
-                rotation_matrix = new_matrix(4, 4);
-                ident(rotation_matrix);
-            }
-            matrix_mult(rotation_matrix, transform);
-            free_matrix(rotation_matrix);
+            if ( sscanf(params, "%c %d", &axis, &theta) < 2 ) {
+                status = bad_params(line, params);
+            } else {
+                printf("rotating %c axis by %d degrees\n", axis, theta);
+                struct matrix * rotation_matrix;
+                if (axis == 'x') {
+                    rotation_matrix = make_rotX(theta);
+                } else if (axis == 'y') {
+                    rotation_matrix = make_rotY(theta);
+                } else if (axis == 'z') {
+                    rotation_matrix = make_rotZ(theta);
+                } else {
+                    printf("invalid rotation axis\n");
+                    rotation_matrix = new_matrix(4, 4);
+                    ident(rotation_matrix);
+                }
+                matrix_mult(rotation_matrix, transform);
+                free_matrix(rotation_matrix);
+            }
         } else if (strcmp(line, "apply") == 0) {
             printf("applying transformation matrix to edge matrix\n");
             matrix_mult(transform, edges);
+            apply_instances(transform, instances);
         } else if (strcmp(line, "display") == 0) {
             clear_screen(s);
             draw_lines(edges, s, c);
-            display(s);
+            draw_instances(instances, s, c);
+            //untrusted scripts are rendered for the caller, not shown
+            if ( !untrusted )
+                display(s);
         } else if (strcmp(line, "save") == 0) {
-            fgets(params, 255, f);
-            params[strlen(params) - 1] = '\0';
-            //printf(":%s:\n", params);
-            printf("save screen as %s", params);
-            save_ppm(s, params);
+            if ( read_params(params, f) ) {
+                status = missing_params(line);
+                break;
+            }
+            if ( untrusted ) {
+                status = not_allowed(line);
+            } else {
+                //printf(":%s:\n", params);
+                printf("save screen as %s\n", params);
+                if ( save_ppm(s, params) )
+                    status = -1;
+            }
+        } else if (strcmp(line, "mmap") == 0) {
+            if ( read_params(params, f) ) {
+                status = missing_params(line);
+                break;
+            }
+            if ( untrusted ) {
+                status = not_allowed(line);
+            } else {
+                printf("mapping screen to %s\n", params);
+                if ( map_screen(s, params) )
+                    status = -1;
+            }
+        } else if (strcmp(line, "save_edges") == 0) {
+            if ( read_params(params, f) ) {
+                status = missing_params(line);
+                break;
+            }
+            if ( untrusted ) {
+                status = not_allowed(line);
+            } else {
+                printf("saving edges as %s\n", params);
+                if ( save_edges(params, edges, instances) )
+                    status = -1;
+            }
+        } else if (strcmp(line, "load_edges") == 0) {
+            if ( read_params(params, f) ) {
+                status = missing_params(line);
+                break;
+            }
+            if ( untrusted ) {
+                status = not_allowed(line);
+            } else {
+                printf("loading edges from %s\n", params);
+                if ( load_edges(params, edges) )
+                    status = -1;
+            }
+        } else if (strcmp(line, "optimize") == 0) {
+            if ( read_params(params, f) ) {
+                status = missing_params(line);
+                break;
+            }
+            double epsilon;
+            char extra;
+            if ( sscanf(params, "%lf %c", &epsilon, &extra) != 1 || epsilon <= 0 ) {
+                printf("optimize needs a positive epsilon, got: %s\n", params);
+                status = -1;
+            } else {
+                //bring instances into edges so shared corners and
+                //edges between primitives can be welded too
+                flatten_instances(instances, edges);
+                clear_instances(instances);
+                int before = edges->lastcol / 2;
+                printf("optimize: removed %d of %d edges\n", optimize_edges(edges, epsilon), before);
+            }
+        } else if (strcmp(line, "weld") == 0) {
+            if ( read_params(params, f) ) {
+                status = missing_params(line);
+                break;
+            }
+            double epsilon;
+            char extra;
+            if ( sscanf(params, "%lf %c", &epsilon, &extra) != 1 || epsilon < 0 ) {
+                printf("weld needs an epsilon of 0 or more, got: %s\n", params);
+                status = -1;
+            } else if ( epsilon == 0 ) {
+                printf("not welding new meshes\n");
+                weld = 0;
+            } else {
+                printf("welding new meshes within %lf\n", epsilon);
+                weld = epsilon;
+            }
         } else if (strcmp(line, "print") == 0) {
+            //show mesh instances as the edges they stand for
+            struct matrix * flat = new_matrix(edges->rows, edges->cols);
+            copy_matrix(edges, flat);
+            flat->lastcol = edges->lastcol;
+            flatten_instances(instances, flat);
             printf("edge matrix:\n");
-            print_matrix(edges);
+            print_matrix(flat);
+            free_matrix(flat);
             printf("transformation matrix:\n");
             print_matrix(transform);
         } else if (strcmp(line, "circle") == 0) {
-            fgets(params, 255, f);
-            params[strlen(params) - 1] = '\0';
+            if ( read_params(params, f) ) {
+                status = missing_params(line);
+                break;
+            }
             double cx, cy, cz, r;
-            sscanf(params, "%lf %lf %lf %lf", &cx, &cy, &cz, &r);
-            printf("drawing a cricle centered at (%lf, %lf, %lf) with radius %lf\n", cx, cy, cz, r);
-            add_circle(edges, cx, cy, cz, r, 0.01);
+            if ( sscanf(params, "%lf %lf %lf %lf", &cx, &cy, &cz, &r) < 4 ) {
+                status = bad_params(line, params);
+            } else {
+                printf("drawing a cricle centered at (%lf, %lf, %lf) with radius %lf\n", cx, cy, cz, r);
+                add_circle(edges, cx, cy, cz, r, 0.01);
+            }
         } else if (strcmp(line, "bezier") == 0) {
-            fgets(params, 255, f);
-            params[strlen(params) - 1] = '\0';
+            if ( read_params(params, f) ) {
+                status = missing_params(line);
+                break;
+            }
             double x0, y0, x1, y1, x2, y2, x3, y3;
-            sscanf(params, "%lf %lf %lf %lf %lf %lf %lf %lf", &x0, &y0, &x1, &y1, &x2, &y2, &x3, &y3);
-            printf("drawing bezier curve\n");
-            add_curve(edges, x0, y0, x1, y1, x2, y2, x3, y3, 0.01, BEZIER);
+            if ( sscanf(params, "%lf %lf %lf %lf %lf %lf %lf %lf", &x0, &y0, &x1, &y1, &x2, &y2, &x3, &y3) < 8 ) {
+                status = bad_params(line, params);
+            } else {
+                printf("drawing bezier curve\n");
+                add_curve(edges, x0, y0, x1, y1, x2, y2, x3, y3, 0.01, BEZIER);
+            }
         } else if (strcmp(line, "hermite") == 0) {
-            fgets(params, 255, f);
-            params[strlen(params) - 1] = '\0';
+            if ( read_params(params, f) ) {
+                status = missing_params(line);
+                break;
+            }
             double x0, y0, x1, y1, rx0, ry0, rx1, ry1;
-            sscanf(params, "%lf %lf %lf %lf %lf %lf %lf %lf", &x0, &y0, &x1, &y1, &rx0, &ry0, &rx1, &ry1);
-            printf("drawing hermite curve\n");
-            add_curve(edges, x0, y0, x1, y1, rx0, ry0, rx1, ry1, 0.01, HERMITE);
+            if ( sscanf(params, "%lf %lf %lf %lf %lf %lf %lf %lf", &x0, &y0, &x1, &y1, &rx0, &ry0, &rx1, &ry1) < 8 ) {
+                status = bad_params(line, params);
+            } else {
+                printf("drawing hermite curve\n");
+                add_curve(edges, x0, y0, x1, y1, rx0, ry0, rx1, ry1, 0.01, HERMITE);
+            }
         } else if (strcmp(line, "box") == 0) {
-            fgets(params, 255, f);
-            params[strlen(params) - 1] = '\0';
-            double x, y, z, width, height, depth;
-            sscanf(params, "%lf %lf %lf %lf %lf %lf", &x, &y, &z, &width, &height, &depth);
-            printf("drawing box\n");
-            add_box(edges, x, y, z, width, height, depth);
+            if ( read_params(params, f) ) {
+                status = missing_params(line);
+                break;
+            }
+            double box[MESH_PARAMS] = {0};
+            if ( sscanf(params, "%lf %lf %lf %lf %lf %lf", &box[0], &box[1], &box[2], &box[3], &box[4], &box[5]) < 6 ) {
+                status = bad_params(line, params);
+            } else {
+                printf("drawing box\n");
+                add_instance(instances, get_mesh(MESH_BOX, box, 0, weld));
+            }
         } else if (strcmp(line, "sphere") == 0) {
-            fgets(params, 255, f);
-            params[strlen(params) - 1] = '\0';
-            double x, y, z, r;
-            sscanf(params, "%lf %lf %lf %lf", &x, &y, &z, &r);
-            printf("drawing sphere\n");
-            add_sphere(edges, x, y, z, r, 50);
+            if ( read_params(params, f) ) {
+                status = missing_params(line);
+                break;
+            }
+            double sphere[MESH_PARAMS] = {0};
+            int steps = SURFACE_STEPS;
+            if ( sscanf(params, "%lf %lf %lf %lf %d", &sphere[0], &sphere[1], &sphere[2], &sphere[3], &steps) < 4 ) {
+                status = bad_params(line, params);
+            } else {
+                if ( steps < 1 || steps > MAX_SURFACE_STEPS ) {
+                    printf("invalid sphere steps %d, using %d\n", steps, SURFACE_STEPS);
+                    steps = SURFACE_STEPS;
+                }
+                if ( take_surface_points(line, &surface_points, steps) ) {
+                    status = -1;
+                } else {
+                    printf("drawing sphere\n");
+                    add_instance(instances, get_mesh(MESH_SPHERE, sphere, steps, weld));
+                }
+            }
         } else if (strcmp(line, "torus") == 0) {
-            fgets(params, 255, f);
-            params[strlen(params) - 1] = '\0';
-            double x, y, z, r1, r2;
-            sscanf(params, "%lf %lf %lf %lf %lf", &x, &y, &z, &r1, &r2);
-            printf("drawing torus\n");
-            add_torus(edges, x, y, z, r1, r2, 50);
+            if ( read_params(params, f) ) {
+                status = missing_params(line);
+                break;
+            }
+            double torus[MESH_PARAMS] = {0};
+            int steps = SURFACE_STEPS;
+            if ( sscanf(params, "%lf %lf %lf %lf %lf %d", &torus[0], &torus[1], &torus[2], &torus[3], &torus[4], &steps) < 5 ) {
+                status = bad_params(line, params);
+            } else {
+                if ( steps < 1 || steps > MAX_SURFACE_STEPS ) {
+                    printf("invalid torus steps %d, using %d\n", steps, SURFACE_STEPS);
+                    steps = SURFACE_STEPS;
+                }
+                if ( take_surface_points(line, &surface_points, steps) ) {
+                    status = -1;
+                } else {
+                    printf("drawing torus\n");
+                    add_instance(instances, get_mesh(MESH_TORUS, torus, steps, weld));
+                }
+            }
         } else if (strcmp(line, "clear") == 0) {
             printf("clearing edges\n");
-            free_matrix(edges);
-            edges = new_matrix(4, 4);
+            edges->lastcol = 0;
+            clear_instances(instances);
         } else if (strcmp(line, "quit") == 0 || strcmp(line, "exit") == 0 ) {
             break;
         }
@@ -172,5 +405,7 @@ void parse_file ( char * filename,
             printf("> ");
         }
     }
+    unmap_screen();
+    return status;
 }
 
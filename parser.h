@@ -1,12 +1,22 @@
 #ifndef PARSER_H
 #define PARSER_H
 
+#include <stdio.h>
+
 #include "matrix.h"
 #include "ml6.h"
+#include "mesh.h"
 
-void parse_file ( char * filename, 
-		  struct matrix * transform, 
-		  struct matrix * edges,
-		  screen s);
+int parse_file ( char * filename, 
+		 struct matrix * transform, 
+		 struct matrix * edges,
+		 struct instances * instances,
+		 screen s);
+int parse_stream ( FILE * f, 
+		   struct matrix * transform, 
+		   struct matrix * edges,
+		   struct instances * instances,
+		   screen s);
+void set_untrusted_scripts( int on);
 
 #endif
@@ -0,0 +1,233 @@
+/*====================== server.c ========================
+  Long running render daemon on a Unix domain socket.
+
+  A client connects, sends a script body and shuts down its
+  write side. The server renders the script and replies with
+  the final screen as a P3 ppm, then closes the connection.
+  If the body is empty or too big, the client is too slow, or the
+  script fails, the reply is a single "ERROR <reason>" line instead.
+
+  Scripts run with the daemon's privileges, so commands that
+  touch files (save, mmap, save_edges, load_edges) are refused,
+  and display only draws the screen that is sent back.
+
+  Each worker thread owns a render_ctx and accepts connections
+  on the shared listening socket, so framebuffers and edge
+  matrices are reused across requests and up to threads
+  clients are served at once.
+  ==================================================*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "ml6.h"
+#include "display.h"
+#include "matrix.h"
+#include "parser.h"
+#include "batch.h"
+#include "server.h"
+
+#define MAX_REQUEST_BYTES (1 << 20)
+#define CLIENT_TIMEOUT_SECONDS 5
+
+static double ms_between(struct timespec *a, struct timespec *b) {
+    return (b->tv_sec - a->tv_sec) * 1e3 + (b->tv_nsec - a->tv_nsec) / 1e6;
+}
+
+/*
+  Reads until the client shuts down its write side. Returns
+  NULL and sets *error if the body is over MAX_REQUEST_BYTES
+  or the client stops sending before it's done.
+*/
+static char * read_request(int fd, size_t *len, char **error) {
+    size_t size = 4096;
+    char *buf = malloc(size);
+    ssize_t n;
+
+    *len = 0;
+    while ( 1 ) {
+        if ( *len + 1 >= size ) {
+            size *= 2;
+            buf = realloc(buf, size);
+        }
+        n = read(fd, buf + *len, size - *len - 1);
+        if ( n < 0 && errno == EINTR )
+            continue;
+        if ( n == 0 )
+            break;
+        if ( n < 0 ) {
+            *error = errno == EAGAIN || errno == EWOULDBLOCK ?
+                "request timed out" : "could not read request";
+            free(buf);
+            return NULL;
+        }
+        *len += n;
+        if ( *len > MAX_REQUEST_BYTES ) {
+            *error = "request too large";
+            free(buf);
+            return NULL;
+        }
+    }
+    buf[*len] = '\0';
+    return buf;
+}
+
+static void serve(int client, struct render_ctx *ctx) {
+    struct timespec start, parsed, encoded;
+    struct timeval timeout = { CLIENT_TIMEOUT_SECONDS, 0 };
+    char *script, *error = NULL;
+    size_t len;
+    FILE *f;
+    int status = -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    script = read_request(client, &len, &error);
+
+    if ( script && len == 0 ) {
+        error = "empty request";
+        free(script);
+    } else if ( script ) {
+        f = fmemopen(script, len, "r");
+        status = parse_stream(f, ctx->transform, ctx->edges, ctx->instances, *ctx->s);
+        fclose(f);
+        free(script);
+        if ( status )
+            error = "script failed";
+    }
+    clock_gettime(CLOCK_MONOTONIC, &parsed);
+
+    f = fdopen(client, "w");
+    if ( f == NULL ) {
+        close(client);
+        error = "could not reply";
+    } else {
+        if ( error )
+            fprintf(f, "ERROR %s\n", error);
+        else
+            write_ppm(*ctx->s, f);
+        fclose(f);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &encoded);
+
+    printf("request: %zu bytes, %s, render %.2f ms, encode %.2f ms, total %.2f ms\n",
+           len, error ? error : "ok", ms_between(&start, &parsed),
+           ms_between(&parsed, &encoded), ms_between(&start, &encoded));
+    fflush(stdout);
+}
+
+static void * server_worker(void *arg) {
+    int listener = *(int *)arg;
+    struct render_ctx *ctx = new_render_ctx();
+    int client;
+
+    //the pool already uses every core
+    set_encode_threads(1);
+    set_untrusted_scripts(1);
+
+    while ( 1 ) {
+        client = accept(listener, NULL, NULL);
+        if ( client < 0 ) {
+            if ( errno == EINTR || errno == ECONNABORTED )
+                continue;
+            perror("accept");
+            break;
+        }
+        serve(client, ctx);
+    }
+
+    free_render_ctx(ctx);
+    return NULL;
+}
+
+/*
+  Removes a stale socket left at path by an earlier run.
+  Anything else at path is left alone and is an error.
+*/
+static int remove_socket(char *path) {
+    struct stat st;
+
+    if ( lstat(path, &st) < 0 ) {
+        if ( errno == ENOENT )
+            return 0;
+        perror(path);
+        return -1;
+    }
+    if ( !S_ISSOCK(st.st_mode) ) {
+        printf("%s exists and is not a socket\n", path);
+        return -1;
+    }
+    if ( unlink(path) < 0 ) {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+  Listens on the Unix socket at path and serves requests on
+  threads workers. Only returns if the socket can't be set up
+  or every worker has stopped.
+*/
+int run_server(char *path, int threads) {
+    struct sockaddr_un addr;
+    pthread_t *workers;
+    int listener, i, started;
+
+    if ( strlen(path) >= sizeof(addr.sun_path) ) {
+        printf("socket path too long: %s\n", path);
+        return -1;
+    }
+    if ( threads < 1 )
+        threads = 1;
+
+    if ( remove_socket(path) < 0 )
+        return -1;
+
+    //a client hanging up early must not kill the daemon
+    signal(SIGPIPE, SIG_IGN);
+
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if ( listener < 0 ) {
+        perror("socket");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if ( bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+         listen(listener, 128) < 0 ) {
+        perror(path);
+        close(listener);
+        return -1;
+    }
+    printf("listening on %s with %d threads\n", path, threads);
+    fflush(stdout);
+
+    workers = (pthread_t *)malloc(threads * sizeof(pthread_t));
+    started = 0;
+    for (i = 0; i < threads; i++)
+        if ( pthread_create(&workers[started], NULL, server_worker, &listener) == 0 )
+            started++;
+    //with no workers at all, serve on this thread
+    if ( started == 0 )
+        server_worker(&listener);
+    for (i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+
+    free(workers);
+    close(listener);
+    remove_socket(path);
+    return -1;
+}
@@ -0,0 +1,6 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+int run_server(char *path, int threads);
+
+#endif